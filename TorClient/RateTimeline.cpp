@@ -0,0 +1,147 @@
+#include "RateTimeline.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+std::int64_t RateTimeline::unixTime() {
+	return std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::uint16_t RateTimeline::encodeRate(std::uint32_t rate) {
+	int shift = 0;
+	while ((rate >> shift) >= 2048) ++shift;
+	return std::uint16_t(shift * 2048 + (rate >> shift));
+}
+
+std::uint32_t RateTimeline::decodeRate(std::uint16_t code) {
+	int const shift = code / 2048;
+	std::uint32_t const mantissa = code % 2048;
+	return shift == 0 ? mantissa : (mantissa << shift) | (1u << (shift - 1));
+}
+
+void RateTimeline::record(int download_rate, int upload_rate, int peers, int progress_ppm, std::int64_t unix_time) {
+	std::uint32_t const download = std::uint32_t(std::max(download_rate, 0));
+	std::uint32_t const upload = std::uint32_t(std::max(upload_rate, 0));
+	RateSample sample;
+	sample.download_rate = encodeRate(download);
+	sample.upload_rate = encodeRate(upload);
+	sample.peers = std::uint8_t(std::min(std::max(peers, 0), 0xff));
+	sample.progress = std::uint8_t(std::min(std::max(progress_ppm, 0), 1000000) / 5000);
+
+	std::lock_guard<std::mutex> guard(lock);
+	hour.push(sample);
+	hour_end = unix_time;
+	// the weekly averages use the exact rates, not the encoded ones
+	sum_download += download;
+	sum_upload += upload;
+	sum_peers += sample.peers;
+	sum_progress += sample.progress;
+	if (++pending == week_interval / hour_interval) pushWeekBucket(unix_time);
+}
+
+void RateTimeline::gap(std::size_t seconds) {
+	if (seconds == 0) return;
+	std::size_t const bucket = week_interval / hour_interval;
+	std::lock_guard<std::mutex> guard(lock);
+	// nothing recorded yet, so there's no history to keep aligned
+	if (hour_end == 0) return;
+	std::int64_t time = hour_end;
+	hour_end += std::int64_t(seconds);
+
+	if (seconds >= hour_samples) {
+		hour.clear();
+	}
+	else {
+		for (std::size_t i = 0; i < seconds; ++i) hour.push(RateSample());
+	}
+
+	// the missed seconds count as zeros: complete the current bucket, push empty
+	// buckets for the whole intervals missed and start the next one part way in
+	std::size_t const fill = std::min(seconds, bucket - pending);
+	pending += fill;
+	time += std::int64_t(fill);
+	if (pending < bucket) return;
+	pushWeekBucket(time);
+	std::size_t const left = seconds - fill;
+	std::size_t const empty = left / bucket;
+	for (std::size_t i = 0; i < std::min(empty, week_samples); ++i) week.push(RateSample());
+	if (empty > 0) week_end = time + std::int64_t(empty * bucket);
+	pending = left % bucket;
+}
+
+void RateTimeline::pushWeekBucket(std::int64_t unix_time) {
+	RateSample average;
+	average.download_rate = encodeRate(std::uint32_t(sum_download / pending));
+	average.upload_rate = encodeRate(std::uint32_t(sum_upload / pending));
+	average.peers = std::uint8_t(sum_peers / pending);
+	average.progress = std::uint8_t(sum_progress / pending);
+	week.push(average);
+	week_end = unix_time;
+	sum_download = sum_upload = sum_peers = sum_progress = 0;
+	pending = 0;
+}
+
+std::vector<int> RateTimeline::recentDownloadRates(std::size_t n) const {
+	std::lock_guard<std::mutex> guard(lock);
+	n = std::min(n, hour.size());
+	std::vector<int> rates;
+	rates.reserve(n);
+	for (std::size_t i = hour.size() - n; i < hour.size(); ++i) {
+		rates.push_back(int(decodeRate(hour[i].download_rate)));
+	}
+	return rates;
+}
+
+namespace {
+	template <std::size_t N>
+	nlohmann::json seriesToJson(const RingBuffer<RateSample, N> &buf, int interval, std::int64_t end) {
+		nlohmann::json j;
+		j["interval"] = interval;
+		j["end"] = end;
+		j["download_rate"] = nlohmann::json::array();
+		j["upload_rate"] = nlohmann::json::array();
+		j["peers"] = nlohmann::json::array();
+		j["progress"] = nlohmann::json::array();
+		for (std::size_t i = 0; i < buf.size(); ++i) {
+			j["download_rate"].push_back(RateTimeline::decodeRate(buf[i].download_rate));
+			j["upload_rate"].push_back(RateTimeline::decodeRate(buf[i].upload_rate));
+			j["peers"].push_back(buf[i].peers);
+			j["progress"].push_back(buf[i].progress / 2.0);
+		}
+		return j;
+	}
+} // anonymous namespace
+
+nlohmann::json RateTimeline::toJson() const {
+	std::lock_guard<std::mutex> guard(lock);
+	nlohmann::json j;
+	j["hour"] = seriesToJson(hour, hour_interval, hour_end);
+	j["week"] = seriesToJson(week, week_interval, week_end);
+	return j;
+}
+
+void benchmarkRateTimeline(int torrents) {
+	using clk = std::chrono::steady_clock;
+	std::vector<std::unique_ptr<RateTimeline>> timelines;
+	timelines.reserve(torrents);
+	for (int i = 0; i < torrents; ++i) {
+		timelines.push_back(std::make_unique<RateTimeline>());
+	}
+	auto const start = clk::now();
+	for (int second = 0; second < int(RateTimeline::hour_samples); ++second) {
+		std::int64_t const now = RateTimeline::unixTime();
+		for (int i = 0; i < torrents; ++i) {
+			timelines[i]->record(second * 1000 + i, i, i % 100, second * 250, now);
+		}
+	}
+	auto const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now() - start).count();
+	long long const records = (long long)torrents * RateTimeline::hour_samples;
+	std::cout << "rate timeline: " << torrents << " torrents, "
+		<< sizeof(RateTimeline) << " B per torrent, "
+		<< (sizeof(RateTimeline) * torrents / (1024 * 1024)) << " MiB total\n"
+		<< "rate timeline: " << records << " records, "
+		<< (records ? elapsed / records : 0) << " ns per record, "
+		<< (elapsed / RateTimeline::hour_samples / 1000) << " us per 1 s tick" << std::endl;
+}
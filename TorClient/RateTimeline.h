@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <vector>
+
+/// <summary>
+/// one point of a torrent rate history, 6 B. rates are stored in the compact
+/// RateTimeline::encodeRate() form, peers saturate at 255.
+/// </summary>
+struct RateSample {
+    std::uint16_t download_rate = 0, upload_rate = 0; // encoded bytes per second
+    std::uint8_t peers = 0, progress = 0;             // progress in 1/2 of a percent
+};
+
+/// <summary>
+/// fixed capacity ring buffer, the oldest element is overwritten when full.
+/// storage is inline, so pushing never allocates.
+/// </summary>
+template <typename T, std::size_t N>
+class RingBuffer {
+public:
+    void push(const T &value) {
+        data[head] = value;
+        head = (head + 1) % N;
+        if (count < N) ++count;
+    }
+
+    std::size_t size() const { return count; }
+
+    static constexpr std::size_t capacity() { return N; }
+
+    void clear() { head = count = 0; }
+
+    /// <summary>
+    /// element by age, 0 is the oldest one.
+    /// </summary>
+    const T &operator[](std::size_t i) const { return data[(head + N - count + i) % N]; }
+
+private:
+    std::array<T, N> data{};
+    std::size_t head = 0, count = 0;
+};
+
+/// <summary>
+/// per torrent history of download and upload rates, peers and progress.
+/// the last hour is kept at 1 s resolution, the last week at 5 min resolution
+/// (averages of the 1 s samples). memory is fixed at construction:
+/// 3600 * 6 B + 2016 * 6 B, about 33 KiB per torrent or 322 MiB for 10 000
+/// torrents. recording takes a mutex and never allocates; run the program with
+/// --bench-timeline to measure both on the target machine.
+/// </summary>
+class RateTimeline {
+public:
+    static constexpr int hour_interval = 1, week_interval = 300; // seconds per sample
+    static constexpr std::size_t hour_samples = 60 * 60 / hour_interval;
+    static constexpr std::size_t week_samples = 7 * 24 * 60 * 60 / week_interval;
+
+    /// <summary>
+    /// appends a 1 s sample taken at unix_time (seconds). called once per second
+    /// from the torrent thread.
+    /// </summary>
+    void record(int download_rate, int upload_rate, int peers, int progress_ppm, std::int64_t unix_time);
+    /// <summary>
+    /// records seconds that were missed (the torrent thread stalled or the machine
+    /// slept) as zeros, so older samples stay at the right distance from "end".
+    /// a gap longer than the hour window clears the hour series.
+    /// </summary>
+    void gap(std::size_t seconds);
+    /// <summary>
+    /// current unix time in seconds, to be read once per tick and passed to record().
+    /// </summary>
+    static std::int64_t unixTime();
+    /// <summary>
+    /// packs a rate into 16 bits like a small float: exact below 2048 B/s, 11 bit
+    /// mantissa above, so the error stays under 0.1% up to 4 GB/s.
+    /// </summary>
+    static std::uint16_t encodeRate(std::uint32_t rate);
+    /// <summary>
+    /// inverse of encodeRate(), returns the middle of the encoded range.
+    /// </summary>
+    static std::uint32_t decodeRate(std::uint16_t code);
+    /// <summary>
+    /// returns up to n most recent 1 s download rates, oldest first.
+    /// </summary>
+    std::vector<int> recentDownloadRates(std::size_t n) const;
+    /// <summary>
+    /// returns the whole history as json series: {"hour": {...}, "week": {...}}.
+    /// each series has "interval" (seconds per sample) and "end" (unix time in
+    /// seconds of the newest sample, 0 if empty); samples are oldest first and
+    /// evenly spaced back from "end". the week series doesn't include the current
+    /// partial 5 min bucket, those seconds are only in the hour series.
+    /// </summary>
+    nlohmann::json toJson() const;
+
+private:
+    mutable std::mutex lock;
+    RingBuffer<RateSample, hour_samples> hour;
+    RingBuffer<RateSample, week_samples> week;
+    // unix time in seconds of the newest sample in each buffer
+    std::int64_t hour_end = 0, week_end = 0;
+    // sums of the 1 s samples not yet folded into the weekly buffer
+    std::uint64_t sum_download = 0, sum_upload = 0, sum_peers = 0, sum_progress = 0;
+    std::size_t pending = 0;
+
+    /// <summary>
+    /// pushes the average of the pending seconds to the weekly buffer.
+    /// </summary>
+    void pushWeekBucket(std::int64_t unix_time);
+};
+
+/// <summary>
+/// records an hour of samples into timelines for the given number of torrents
+/// and prints memory use and time per record.
+/// </summary>
+void benchmarkRateTimeline(int torrents);
@@ -4,24 +4,30 @@
 #include "libtorrent/span.hpp"
 #include "libtorrent/torrent_info.hpp"
 #include "QWidget"
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/log/trivial.hpp>
 #include <chrono>
 #include <cinttypes> // for PRId64 et.al.
 #include <csignal>
+#include <condition_variable>
 #include <cstdio> // for snprintf
 #include <fstream>
 #include <iostream>
 #include <libtorrent/add_torrent_params.hpp>
+#include <libtorrent/address.hpp>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/bencode.hpp>
 #include <libtorrent/error_code.hpp>
+#include <libtorrent/kademlia/dht_state.hpp>
 #include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/peer_info.hpp>
 #include <libtorrent/read_resume_data.hpp>
 #include <libtorrent/session.hpp>
 #include <libtorrent/torrent_handle.hpp>
 #include <libtorrent/torrent_status.hpp>
 #include <libtorrent/write_resume_data.hpp>
+#include <memory>
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include <QDir>
@@ -29,6 +35,7 @@
 #include <QtGui>
 #include <string>
 #include <thread>
+#include <vector>
 
 using nlohmann::json;
 namespace filesys = boost::filesystem;
@@ -47,29 +54,68 @@ void clearLayout(QLayout *layout, bool deleteWidgets = true) {
 
 std::mutex file_lock, process_lock;
 
+// torrent threads still running, TorClient waits for them on exit
+std::mutex workers_lock;
+std::condition_variable workers_done;
+int running_workers = 0;
+
+RateSparkline::RateSparkline(std::shared_ptr<const RateTimeline> timeline_, QWidget *parent_) : QWidget(parent_), timeline(std::move(timeline_)) {
+	setFixedWidth(200);
+	setFixedHeight(40);
+	// repaint from the GUI thread, the torrent thread only records into the timeline
+	connect(refresh, SIGNAL(timeout()), this, SLOT(update()));
+	refresh->start(RateTimeline::hour_interval * 1000);
+}
+
+void RateSparkline::paintEvent(QPaintEvent *event) {
+	auto const rates = timeline->recentDownloadRates(std::size_t(width()));
+	if (rates.size() < 2) return;
+	int const peak = std::max(*std::max_element(rates.begin(), rates.end()), 1);
+	int const x0 = width() - int(rates.size());
+	QPolygon line;
+	for (std::size_t i = 0; i < rates.size(); ++i) {
+		line << QPoint(x0 + int(i), height() - 1 - int((long long)rates[i] * (height() - 2) / peak));
+	}
+	QPainter painter(this);
+	painter.setPen(QColor(0, 120, 215));
+	painter.drawPolyline(line);
+}
+
 TorProcess::TorProcess(const std::string torlink_, const std::string save_path_, lt::session *s_, TorClient *parent_) : QWidget(parent_),
-parent(parent_), torlink(torlink_), save_path(save_path_), s(s_), stop(false) {
+parent(parent_), torlink(torlink_), save_path(save_path_), s(s_) {
 	body->addWidget(lname);
 	body->addWidget(lstatus);
 	lstatus->setFixedWidth(500);
+	body->addWidget(sparkline);
 	filesys::path fpath(torlink);
 	lname->setText(fpath.filename().string().c_str());
 	connect(bshow_info, SIGNAL(clicked()), this, SLOT(setTextInfo()));
 	getTorInfo();
-	std::thread(&TorProcess::torDownload, this).detach();
+	{
+		std::lock_guard<std::mutex> lock(workers_lock);
+		++running_workers;
+	}
+	std::thread(&TorProcess::torDownload, shared, torlink, save_path, magnet_link).detach();
+	connect(status_refresh, SIGNAL(timeout()), this, SLOT(updateStatus()));
+	status_refresh->start(200);
 	bdelete->setFixedWidth(100);
 	bdelete->setFixedHeight(40);
 	bshow_info->setFixedWidth(100);
 	bshow_info->setFixedHeight(40);
+	bshow_history->setFixedWidth(100);
+	bshow_history->setFixedHeight(40);
 	body->addWidget(bdelete);
 	body->addWidget(bshow_info);
+	body->addWidget(bshow_history);
+	connect(bshow_history, SIGNAL(clicked()), this, SLOT(setTextHistory()));
 	connect(bdelete, SIGNAL(clicked()), this, SLOT(onDeleteClicked()));
 	connect(this, SIGNAL(sendDeleteClicked(TorProcess *)), parent, SLOT(deleteTorrent(TorProcess *)));
 	show();
 }
 
 TorProcess::~TorProcess() {
-	stop = true;
+	// the thread shuts the session down on its own, see TorShared
+	shared->stop = true;
 	//delete body;
 	//delete lname;
 }
@@ -116,22 +162,277 @@ namespace {
 
 	void sighandler(int) { shut_down = true; }
 
+	// session state (settings and DHT routing table) shared by all torrents
+	char const *const shared_session_path = "sessions/client.session";
+
+	// how often torrent sessions publish their DHT nodes and TorClient writes them to disk
+	auto const dht_save_interval = std::chrono::minutes(5);
+
+	// how many DHT nodes per address family are kept in the shared session file
+	std::size_t const max_dht_nodes = 200;
+
+	// how many recently good peers are remembered per torrent
+	std::size_t const max_cached_peers = 50;
+
+	// how long after startup the download rate is sampled to find full speed
+	auto const startup_window = std::chrono::minutes(2);
+
+	std::string info_hash_str(lt::info_hash_t const &ih)
+	{
+		std::stringstream ss;
+		ss << ih.get_best();
+		return ss.str();
+	}
+
+	long long to_ms(clk::duration d)
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+	}
+
+	// decodes a session file into params. returns false and leaves params untouched
+	// if the file is missing or damaged, e.g. by a crash in the middle of a write.
+	bool read_session_file(char const *path, lt::session_params &params) try
+	{
+		auto const buf = load_file(path);
+		if (buf.empty()) return false;
+		params = lt::read_session_params(buf);
+		return true;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: session file " << path << ": " << e.what() << "\n";
+		return false;
+	}
+
+	// writes data to a temporary file and renames it over path, so a crash
+	// in the middle of the write can't leave a torn file behind.
+	bool write_file_atomic(std::string const &path, char const *data, std::size_t size)
+	{
+		std::string const tmp_path = path + ".tmp";
+		{
+			std::ofstream of(tmp_path.c_str(), std::ios_base::binary);
+			of.unsetf(std::ios_base::skipws);
+			of.write(data, std::streamsize(size));
+			of.close();
+			if (of.fail()) {
+				std::cerr << "ERROR: can't write " << tmp_path << "\n";
+				return false;
+			}
+		}
+		boost::system::error_code ec;
+		filesys::rename(tmp_path, path, ec);
+		if (ec) {
+			std::cerr << "ERROR: can't replace " << path << ": " << ec.message() << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	// session state shared by all torrents. torrent threads merge their DHT nodes
+	// into it in memory and TorClient is the only one writing it to disk.
+	std::mutex shared_state_lock;
+	lt::session_params shared_state;
+	bool shared_state_loaded = false, shared_state_found = false, shared_state_dirty = false;
+
+	// loads the shared session state (read from disk once per run), falling back
+	// to the per torrent session file written by older versions.
+	lt::session_params load_session_params(std::string const &legacy_path)
+	{
+		lt::session_params params;
+		bool found;
+		{
+			std::lock_guard<std::mutex> lock(shared_state_lock);
+			if (!shared_state_loaded) {
+				shared_state_loaded = true;
+				std::lock_guard<std::mutex> flock(file_lock);
+				shared_state_found = read_session_file(shared_session_path, shared_state);
+			}
+			found = shared_state_found;
+			if (found) params = shared_state;
+		}
+		if (!found) read_session_file(legacy_path.c_str(), params);
+		// all torrents share the stored state, so let every session pick its own node id
+		params.dht_state.nids.clear();
+		return params;
+	}
+
+	// appends the nodes of src missing from dst, keeping at most max_dht_nodes
+	void merge_dht_nodes(std::vector<lt::udp::endpoint> &dst, std::vector<lt::udp::endpoint> const &src)
+	{
+		for (auto const &ep : src) {
+			if (dst.size() >= max_dht_nodes) break;
+			if (std::find(dst.begin(), dst.end(), ep) == dst.end()) dst.push_back(ep);
+		}
+		if (dst.size() > max_dht_nodes) dst.resize(max_dht_nodes);
+	}
+
+	// merges the settings and DHT nodes of a torrent session into the shared state.
+	// every session has a partial routing table, so its nodes go first and the
+	// known ones fill up the rest. no file io, see flush_session_state().
+	void publish_session_state(lt::session const &ses)
+	{
+		lt::session_params params = ses.session_state(lt::save_state_flags_t::all());
+		params.dht_state.nids.clear();
+		std::lock_guard<std::mutex> lock(shared_state_lock);
+		merge_dht_nodes(params.dht_state.nodes, shared_state.dht_state.nodes);
+		merge_dht_nodes(params.dht_state.nodes6, shared_state.dht_state.nodes6);
+		if (params.dht_state.nodes == shared_state.dht_state.nodes
+			&& params.dht_state.nodes6 == shared_state.dht_state.nodes6) return;
+		shared_state = std::move(params);
+		shared_state_found = shared_state_dirty = true;
+	}
+
+	// writes the shared session state to disk if it changed since the last write
+	void flush_session_state()
+	{
+		std::vector<char> b;
+		{
+			std::lock_guard<std::mutex> lock(shared_state_lock);
+			if (!shared_state_dirty) return;
+			b = write_session_params_buf(shared_state, lt::save_state_flags_t::all());
+			shared_state_dirty = false;
+		}
+		std::lock_guard<std::mutex> lock(file_lock);
+		write_file_atomic(shared_session_path, b.data(), b.size());
+	}
+
+	// loads peers that were recently useful for the torrent with the given info hash
+	std::vector<lt::tcp::endpoint> load_peer_cache(std::string const &path, lt::info_hash_t const &ih) try
+	{
+		std::vector<lt::tcp::endpoint> peers;
+		if (!filesys::exists(path)) return peers;
+		json j;
+		filesys::ifstream f(path);
+		f >> j;
+		if (j.value("info_hash", std::string()) != info_hash_str(ih)) return peers;
+		for (auto const &p : j["peers"]) {
+			peers.emplace_back(lt::make_address(p["ip"].get<std::string>()), p["port"].get<std::uint16_t>());
+		}
+		return peers;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: peer cache " << path << ": " << e.what() << "\n";
+		return {};
+	}
+
+	// remembers the peers we exchanged payload with, best first, so they can be
+	// connected to directly on the next start instead of waiting for trackers and DHT.
+	// only outgoing connections are kept: for incoming ones the remote port is a
+	// temporary one, not the port the peer listens on.
+	// an existing cache is kept if no peer is currently useful.
+	void save_peer_cache(std::string const &path, lt::torrent_handle const &h)
+	{
+		if (!h.is_valid()) return;
+		std::vector<lt::peer_info> peers;
+		h.get_peer_info(peers);
+		peers.erase(std::remove_if(peers.begin(), peers.end(), [](lt::peer_info const &p) {
+			return !(p.flags & lt::peer_info::local_connection)
+				|| (p.flags & (lt::peer_info::connecting | lt::peer_info::handshake))
+				|| (p.total_download == 0 && p.total_upload == 0);
+		}), peers.end());
+		if (peers.empty()) return;
+		std::sort(peers.begin(), peers.end(), [](lt::peer_info const &a, lt::peer_info const &b) {
+			return a.total_download + a.total_upload > b.total_download + b.total_upload;
+		});
+		if (peers.size() > max_cached_peers) peers.resize(max_cached_peers);
+
+		json j;
+		j["info_hash"] = info_hash_str(h.info_hashes());
+		j["peers"] = json::array();
+		for (auto const &p : peers) {
+			j["peers"].push_back({ { "ip", p.ip.address().to_string() }, { "port", p.ip.port() } });
+		}
+		auto const b = j.dump();
+		write_file_atomic(path, b.data(), b.size());
+	}
+
+	// measures how quickly a torrent gets going after startup: the time to the
+	// first connected peer and the time to full speed, i.e. the first moment the
+	// download rate reached 90% of the peak seen within startup_window (or until
+	// the torrent stopped, if that was earlier).
+	struct startup_metrics {
+		clk::time_point const start = clk::now();
+		bool first_peer_logged = false, full_speed_logged = false;
+		std::vector<std::pair<clk::duration, int>> rates;
+
+		void update(std::string const &name, lt::torrent_status const &s)
+		{
+			auto const elapsed = clk::now() - start;
+			if (!first_peer_logged && s.num_peers > 0) {
+				first_peer_logged = true;
+				BOOST_LOG_TRIVIAL(info) << name << ": time to first peer " << to_ms(elapsed) << " ms";
+			}
+			if (full_speed_logged) return;
+			if (elapsed < startup_window) {
+				rates.emplace_back(elapsed, s.download_payload_rate);
+				return;
+			}
+			log_full_speed(name);
+		}
+
+		// logs whatever was not measured yet, called when the torrent stops
+		void finish(std::string const &name)
+		{
+			if (!first_peer_logged) {
+				first_peer_logged = true;
+				BOOST_LOG_TRIVIAL(info) << name << ": no peer connected in " << to_ms(clk::now() - start) << " ms";
+			}
+			if (!full_speed_logged) log_full_speed(name);
+		}
+
+	private:
+		void log_full_speed(std::string const &name)
+		{
+			full_speed_logged = true;
+			int peak = 0;
+			for (auto const &r : rates) peak = std::max(peak, r.second);
+			auto const it = std::find_if(rates.begin(), rates.end(), [peak](std::pair<clk::duration, int> const &r) {
+				return peak > 0 && r.second >= peak / 10 * 9;
+			});
+			if (it == rates.end()) {
+				BOOST_LOG_TRIVIAL(info) << name << ": no payload downloaded during startup";
+			}
+			else {
+				BOOST_LOG_TRIVIAL(info) << name << ": time to full speed " << to_ms(it->first)
+					<< " ms (" << (peak / 1000) << " kB/s)";
+			}
+			std::vector<std::pair<clk::duration, int>>().swap(rates);
+		}
+	};
+
+	// counts a torrent thread as finished when it leaves torDownload()
+	struct worker_guard {
+		~worker_guard()
+		{
+			std::lock_guard<std::mutex> lock(workers_lock);
+			--running_workers;
+			workers_done.notify_all();
+		}
+	};
+
 } // anonymous namespace
 
-void TorProcess::torDownload() try {
+void TorProcess::torDownload(std::shared_ptr<TorShared> shared, std::string torlink, std::string save_path, std::string magnet_link) try {
+	worker_guard running;
 	// load session parameters
 	std::string sesssion_path = std::string("sessions/") + filesys::path(torlink).filename().string() + std::string(".session");
 	std::string resume_path = std::string("sessions/") + filesys::path(torlink).filename().string() + std::string(".resume_file");
-	auto session_params = load_file(sesssion_path.c_str());
-	lt::session_params params = session_params.empty()
-		? lt::session_params() : lt::read_session_params(session_params);
+	std::string peers_path = std::string("sessions/") + filesys::path(torlink).filename().string() + std::string(".peers");
+	std::string name = filesys::path(torlink).filename().string();
+	lt::session_params params = load_session_params(sesssion_path);
 	params.settings.set_int(lt::settings_pack::alert_mask
 		, lt::alert_category::error
 		| lt::alert_category::storage
 		| lt::alert_category::status);
 
 	lt::session ses(params);
-	clk::time_point last_save_resume = clk::now();
+	clk::time_point last_save_resume = clk::now(), last_save_dht = clk::now();
+	startup_metrics metrics;
+	// latest known status, sampled into the rate timeline once per second even
+	// when no state update was posted because nothing changed
+	clk::time_point next_sample = clk::now() + std::chrono::seconds(RateTimeline::hour_interval);
+	int download_rate = 0, upload_rate = 0, num_peers = 0, progress_ppm = 0;
 
 	// load resume data from disk and pass it in as we add the magnet link
 	auto buf = load_file(resume_path.c_str());
@@ -143,6 +444,8 @@ void TorProcess::torDownload() try {
 		if (atp.info_hashes == magnet.info_hashes) magnet = std::move(atp);
 	}
 	magnet.save_path = save_path; // save in current dir
+	// peers that were useful last time, connected to as soon as the torrent is added
+	auto const cached_peers = load_peer_cache(peers_path, magnet.info_hashes);
 	ses.async_add_torrent(std::move(magnet));
 
 	// this is the handle we'll set once we get the notification of it being
@@ -166,6 +469,10 @@ void TorProcess::torDownload() try {
 		for (lt::alert const *a : alerts) {
 			if (auto at = lt::alert_cast<lt::add_torrent_alert>(a)) {
 				h = at->handle;
+				if (!at->error) {
+					for (auto const &ep : cached_peers) h.connect_peer(ep);
+					BOOST_LOG_TRIVIAL(trace) << name << ": reconnecting " << cached_peers.size() << " cached peers";
+				}
 			}
 			// if we receive the finished alert or an error, we're done
 			if (lt::alert_cast<lt::torrent_finished_alert>(a)) {
@@ -198,13 +505,30 @@ void TorProcess::torDownload() try {
 					<< (s.total_done / 1000) << " kB ("
 					<< (s.progress_ppm / 10000) << "%) downloaded ("
 					<< s.num_peers << " peers)\x1b[K" << std::endl;
-				status_str = state(s.state) + ' ' + std::to_string(s.download_payload_rate / 1000)
+				std::string status_str = state(s.state) + ' ' + std::to_string(s.download_payload_rate / 1000)
 					+ std::string(" kB/s ") + std::to_string(s.total_done / 1000) + std::string(" kB (") +
 					std::to_string(s.progress_ppm / 10000) + "%) downloaded ("
 					+ std::to_string(s.num_peers) + std::string(" peers)\x1b[K\n");
-				lstatus->setText(status_str.c_str());
+				{
+					std::lock_guard<std::mutex> lock(shared->status_lock);
+					shared->status_str = std::move(status_str);
+				}
+				metrics.update(name, s);
+				download_rate = s.download_payload_rate;
+				upload_rate = s.upload_payload_rate;
+				num_peers = s.num_peers;
+				progress_ppm = s.progress_ppm;
 			}
 		}
+		if (clk::now() >= next_sample) {
+			// seconds missed while the loop stalled (or the machine slept) are recorded
+			// as a gap, the last rates seen before it are not repeated
+			auto const interval = std::chrono::seconds(RateTimeline::hour_interval);
+			auto const missed = (clk::now() - next_sample) / interval;
+			shared->timeline.gap(std::size_t(missed));
+			shared->timeline.record(download_rate, upload_rate, num_peers, progress_ppm, RateTimeline::unixTime());
+			next_sample += interval * (missed + 1);
+		}
 		std::this_thread::sleep_for(std::chrono::milliseconds(200));
 		// ask the session to post a state_update_alert, to update our
 		// state output for the torrent
@@ -212,21 +536,23 @@ void TorProcess::torDownload() try {
 		// save resume data once every 30 seconds
 		if (clk::now() - last_save_resume > std::chrono::seconds(30)) {
 			h.save_resume_data(lt::torrent_handle::save_info_dict);
+			save_peer_cache(peers_path, h);
 			last_save_resume = clk::now();
 		}
-		if (stop) {
+		// keep the persisted DHT routing table fresh
+		if (clk::now() - last_save_dht > dht_save_interval) {
+			publish_session_state(ses);
+			last_save_dht = clk::now();
+		}
+		if (shared->stop) {
 			break;
 		}
 	}
 done:
+	metrics.finish(name);
 	std::cout << "\nsaving session state" << std::endl;
-	{
-		std::ofstream of(sesssion_path.c_str(), std::ios_base::binary);
-		of.unsetf(std::ios_base::skipws);
-		auto const b = write_session_params_buf(ses.session_state()
-			, lt::save_state_flags_t::all());
-		of.write(b.data(), int(b.size()));
-	}
+	save_peer_cache(peers_path, h);
+	publish_session_state(ses);
 
 	std::cout << "\ndone, shutting down" << std::endl;
 }
@@ -331,6 +657,19 @@ void TorProcess::setTextInfo() {
 	parent->bottom_text->setText(tor_info.c_str());
 }
 
+void TorProcess::setTextHistory() {
+	parent->bottom_text->setText(shared->timeline.toJson().dump().c_str());
+}
+
+void TorProcess::updateStatus() {
+	std::string status_str;
+	{
+		std::lock_guard<std::mutex> lock(shared->status_lock);
+		status_str = shared->status_str;
+	}
+	lstatus->setText(status_str.c_str());
+}
+
 void TorProcess::onDeleteClicked() {
 	emit sendDeleteClicked(this);
 }
@@ -370,12 +709,34 @@ TorClient::TorClient(QWidget *parent) : QMainWindow(parent), j_data_path("data.j
 	this->setCentralWidget(wid);
 	loadData();
 
-
+	connect(session_timer, SIGNAL(timeout()), this, SLOT(saveSessionState()));
+	session_timer->start(int(std::chrono::milliseconds(dht_save_interval).count()));
 
 	BOOST_LOG_TRIVIAL(trace) << "TORCLIENT INITIALISATION FINIHSED";
 	show();
 }
 
+TorClient::~TorClient() {
+	// stop all torrents at once so their sessions shut down in parallel, they
+	// publish their final DHT state on the way out
+	for (TorProcess *tp : process_lines) {
+		delete tp;
+	}
+	process_lines.clear();
+	{
+		std::unique_lock<std::mutex> lock(workers_lock);
+		if (!workers_done.wait_for(lock, std::chrono::seconds(30), [] { return running_workers == 0; })) {
+			BOOST_LOG_TRIVIAL(warning) << running_workers << " TORRENTS STILL SHUTTING DOWN";
+		}
+	}
+	flush_session_state();
+}
+
+void TorClient::saveSessionState() {
+	flush_session_state();
+	BOOST_LOG_TRIVIAL(trace) << "SESSION STATE SAVED";
+}
+
 void TorClient::onOpenTorrent() {
 	std::string str = QFileDialog::getOpenFileName(this, "Open a torrent file", QDir::currentPath(), "*.torrent").toStdString();
 	if (str.size() > 0) {
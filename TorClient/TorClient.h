@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <boost/filesystem.hpp>
 #include <boost/log/trivial.hpp>
 #include <chrono>
@@ -16,6 +17,8 @@
 #include <libtorrent/torrent_status.hpp>
 #include <libtorrent/write_resume_data.hpp>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <QFileDialog>
 #include <QHBoxLayout>
@@ -28,21 +31,49 @@
 #include <QToolBar>
 #include <QVBoxLayout>
 #include <QWidget>
+#include <QPainter>
+#include <QTimer>
 #include <QscrollArea>
 #include <set>
 #include <thread>
 #include <QtextEdit>
+#include "RateTimeline.h"
 
 using nlohmann::json;
 namespace filesys = boost::filesystem;
 
 class TorClient;
 
+class RateSparkline : public QWidget {
+    Q_OBJECT
+public:
+    RateSparkline(std::shared_ptr<const RateTimeline> timeline_, QWidget *parent_ = nullptr);
+
+protected:
+    std::shared_ptr<const RateTimeline> timeline;
+    QTimer *refresh = new QTimer(this);
+    /// <summary>
+    /// draws the download rate of the last seconds, one pixel per second.
+    /// </summary>
+    void paintEvent(QPaintEvent *event) override;
+};
+
+/// <summary>
+/// state shared by a TorProcess and its torrent thread. the thread keeps its own
+/// reference, so deleting the widget never waits for the session to shut down.
+/// </summary>
+struct TorShared {
+    std::atomic<bool> stop{ false };
+    RateTimeline timeline;
+    std::mutex status_lock;
+    std::string status_str;
+};
+
 class TorProcess : public QWidget {
     Q_OBJECT
 public:
     const std::string torlink, save_path;
-    std::string tor_info, status_str, magnet_link;
+    std::string tor_info, magnet_link;
 
     TorProcess(const std::string torlink_, const std::string save_path_, lt::session *s_, TorClient *parent_ = nullptr);
 
@@ -52,27 +83,38 @@ public:
 
 private:
     /// <summary>
-    /// downloads torrent files
+    /// downloads torrent files, runs on its own thread and touches only shared.
     /// </summary>
-    void torDownload();
+    static void torDownload(std::shared_ptr<TorShared> shared, std::string torlink, std::string save_path, std::string magnet_link);
     /// <summary>
     /// extracts information about torrent from file and net.
     /// </summary>
     void getTorInfo();
 
 protected:
-    bool stop;
     TorClient *parent;
     QHBoxLayout *body = new QHBoxLayout;
     QLabel *lname = new QLabel, *lstatus = new QLabel;
-    QPushButton *bdelete = new QPushButton("delete"), *bshow_info = new QPushButton("show info");
+    QPushButton *bdelete = new QPushButton("delete"), *bshow_info = new QPushButton("show info"),
+        *bshow_history = new QPushButton("show history");
     lt::session *s;
+    std::shared_ptr<TorShared> shared = std::make_shared<TorShared>();
+    RateSparkline *sparkline = new RateSparkline(std::shared_ptr<const RateTimeline>(shared, &shared->timeline), this);
+    QTimer *status_refresh = new QTimer(this);
 public slots:
     /// <summary>
     /// sets obtained torrent infromation to edit text box
     /// </summary>
     void setTextInfo();
     /// <summary>
+    /// sets recorded rate history as json series to edit text box
+    /// </summary>
+    void setTextHistory();
+    /// <summary>
+    /// shows the latest status posted by the torrent thread
+    /// </summary>
+    void updateStatus();
+    /// <summary>
     /// wraps delete button clicked signal, sends sendDeleteClicked(TorProcess *tp).
     /// </summary>
     void onDeleteClicked();
@@ -103,11 +145,14 @@ protected:
     std::string j_data_path, save_path, tor_files_path;
     json j_data;
     std::list<TorProcess *> process_lines;
+    QTimer *session_timer = new QTimer(this);
 public:
     QTextEdit *bottom_text = new QTextEdit;
 
     TorClient(QWidget *parent = Q_NULLPTR);
 
+    ~TorClient();
+
 private:
     /// <summary>
     /// loads all program saved data
@@ -142,6 +187,10 @@ public slots:
     /// displays current json form stored info
     /// </summary>
     void showData();
+    /// <summary>
+    /// writes the session state shared by all torrents to disk, if it changed.
+    /// </summary>
+    void saveSessionState();
 signals:
     /// <summary>
     /// sends signal
@@ -39,12 +39,14 @@ int main(int argc, char *argv[]) {
     init();
     bool show_console;
     std::string link;
+    int bench_timeline;
     try {
         po::options_description desc("Generic options");
         desc.add_options()
             ("help", "produce help message")
             ("console,c", po::value<bool>(&show_console)->default_value(false), "show console on start")
             ("link,l", po::value<std::string>(&link)->default_value(std::string("none")), "set the input url")
+            ("bench-timeline", po::value<int>(&bench_timeline)->default_value(0), "benchmark rate timelines for N torrents and exit")
             ;
         po::variables_map vm;
         po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -54,6 +56,11 @@ int main(int argc, char *argv[]) {
             system("pause");
             return 0;
         }
+        if (bench_timeline > 0) {
+            benchmarkRateTimeline(bench_timeline);
+            system("pause");
+            return 0;
+        }
 
     }
     catch (std::exception &e) {